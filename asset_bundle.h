@@ -0,0 +1,192 @@
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+// On-disk layout written by pack_bundle, in host byte order:
+//
+//   header | entry[entry_count] | uint32_t slots[slot_count] |
+//   strings | bodies
+//
+// slots is an open-addressing table probed linearly from hash & (slot_count-1);
+// a slot holds entry index + 1, or 0 when empty. Every body and gzip variant
+// starts on a page boundary so it can be handed to the kernel straight from
+// the mapping.
+namespace bundle_format{
+    const char magic[8] = {'H','T','T','P','B','N','D','L'};
+    const uint32_t version = 1;
+    const uint64_t page_size = 4096;
+
+    struct header{
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_count;
+        uint32_t slot_count;
+        uint32_t reserved;
+        uint64_t entries_offset;
+        uint64_t slots_offset;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+    };
+    struct entry{
+        uint64_t hash;
+        uint32_t path_offset, path_size;
+        uint32_t mime_offset, mime_size;
+        uint32_t etag_offset, etag_size;
+        uint32_t reserved;
+        uint64_t body_offset, body_size;
+        uint64_t gzip_offset, gzip_size;
+    };
+
+    // FNV-1a, used both for the slot table and for ETags.
+    inline uint64_t hash(const char *data,size_t size)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for(size_t i(0);i != size;++i){
+            h ^= (unsigned char)data[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+}
+
+inline std::string mime_type(const std::string &file_name)
+{
+    static std::map<std::string,std::string>format_map{
+        std::make_pair("html","text/html"),
+                std::make_pair("gif","image/gif"),
+                std::make_pair("png","image/png"),
+                std::make_pair("jpg","image/jpeg"),
+                std::make_pair("css","text/css"),
+                std::make_pair("js","application/javascript"),
+                std::make_pair("swf","application/x-shockwave-flash"),
+                std::make_pair("ico","image/x-icon"),
+                std::make_pair("","text/plain"),
+                std::make_pair("txt","text/plain"),
+                std::make_pair("php","application/x-php")
+    };
+    std::vector<std::string>segments;
+    boost::algorithm::split(segments,file_name,boost::is_any_of("."));
+    auto it = format_map.find(segments.back());
+    return it == format_map.end() ? std::string() : it->second;
+}
+
+// Read-only view of a bundle mapped into memory. Lookups are a hash probe
+// plus one path comparison and never touch the filesystem.
+class asset_bundle{
+
+    int fd = -1;
+    const char *base = nullptr;
+    size_t size = 0;
+    const bundle_format::header *header = nullptr;
+    const bundle_format::entry *entries = nullptr;
+    const uint32_t *slots = nullptr;
+
+    bool in_range(uint64_t offset,uint64_t length)const
+    {
+        return offset <= size && length <= size - offset;
+    }
+    bool validate()const
+    {
+        if(size < sizeof(bundle_format::header))return false;
+        if(memcmp(header->magic,bundle_format::magic,sizeof(bundle_format::magic)) != 0)return false;
+        if(header->version != bundle_format::version)return false;
+        if(!header->slot_count || (header->slot_count & (header->slot_count - 1)))return false;
+        if(!in_range(header->entries_offset,(uint64_t)header->entry_count * sizeof(bundle_format::entry)))return false;
+        if(!in_range(header->slots_offset,(uint64_t)header->slot_count * sizeof(uint32_t)))return false;
+        if(!in_range(header->strings_offset,header->strings_size))return false;
+        auto entries = reinterpret_cast<const bundle_format::entry*>(base + header->entries_offset);
+        for(uint32_t i(0);i != header->entry_count;++i)
+        {
+            const bundle_format::entry &e = entries[i];
+            if((uint64_t)e.path_offset + e.path_size > header->strings_size)return false;
+            if((uint64_t)e.mime_offset + e.mime_size > header->strings_size)return false;
+            if((uint64_t)e.etag_offset + e.etag_size > header->strings_size)return false;
+            if(!in_range(e.body_offset,e.body_size) || !in_range(e.gzip_offset,e.gzip_size))return false;
+        }
+        return true;
+    }
+    std::string string_at(uint32_t offset,uint32_t length)const
+    {
+        return std::string(base + header->strings_offset + offset,length);
+    }
+
+public:
+
+    asset_bundle() = default;
+    asset_bundle(const asset_bundle&) = delete;
+    asset_bundle &operator=(const asset_bundle&) = delete;
+    ~asset_bundle(){close();}
+
+    bool open(const std::string &path)
+    {
+        close();
+        struct stat st;
+        fd = ::open(path.c_str(),O_RDONLY | O_CLOEXEC);
+        if(fd == -1 || fstat(fd,&st) != 0){perror("Error opening bundle");close();return false;}
+
+        size = st.st_size;
+        void *mapping = size ? mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0) : MAP_FAILED;
+        if(mapping == MAP_FAILED){perror("Error mapping bundle");size = 0;close();return false;}
+        base = static_cast<const char*>(mapping);
+        header = reinterpret_cast<const bundle_format::header*>(base);
+
+        if(!validate()){
+            fprintf(stderr,"Error loading bundle %s: bad format\n",path.c_str());
+            close();
+            return false;
+        }
+        entries = reinterpret_cast<const bundle_format::entry*>(base + header->entries_offset);
+        slots = reinterpret_cast<const uint32_t*>(base + header->slots_offset);
+        // The index is touched by every request; the bodies can fault in lazily.
+        madvise(const_cast<char*>(base),header->strings_offset + header->strings_size,MADV_WILLNEED);
+        return true;
+    }
+    void close()
+    {
+        if(base)munmap(const_cast<char*>(base),size);
+        if(fd != -1)::close(fd);
+        fd = -1;
+        base = nullptr;
+        size = 0;
+        header = nullptr;
+    }
+    bool is_open()const { return base != nullptr; }
+
+    const bundle_format::entry *find(const std::string &path)const
+    {
+        if(!base)
+            return nullptr;
+        uint64_t h = bundle_format::hash(path.data(),path.size());
+        uint32_t mask = header->slot_count - 1;
+        for(uint32_t i(h & mask),probes(0);probes != header->slot_count;i = (i + 1) & mask,++probes)
+        {
+            uint32_t slot = slots[i];
+            if(!slot || slot > header->entry_count)
+                return nullptr;
+            const bundle_format::entry &e = entries[slot - 1];
+            if(e.hash == h && e.path_size == path.size() &&
+               memcmp(base + header->strings_offset + e.path_offset,path.data(),path.size()) == 0)
+                return &e;
+        }
+        return nullptr;
+    }
+
+    std::string mime(const bundle_format::entry &e)const { return string_at(e.mime_offset,e.mime_size); }
+    std::string etag(const bundle_format::entry &e)const { return string_at(e.etag_offset,e.etag_size); }
+    const char *data(uint64_t offset)const { return base + offset; }
+};
+
+#endif // ASSET_BUNDLE_H
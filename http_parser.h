@@ -1,3 +1,6 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
 #include <boost/fusion/include/std_pair.hpp>
 #include <boost/spirit/include/qi.hpp>
 #include <boost/spirit/include/phoenix_core.hpp>
@@ -11,6 +14,7 @@
 namespace RFC2616{
     enum responses{
         OK = 200,
+        NOT_MODIFIED = 304,
         NOT_FOUND = 404
     };
 }
@@ -246,12 +250,15 @@ struct http_raw_packet{
     std::string start;
     body_type body;
     std::string content;
+    // Start line and header lines as received, filled by http_parser::parse.
+    std::string head;
 
     void operator = (const http_raw_packet &other)
     {
         start = other.start;
         body = other.body;
         content = other.content;
+        head = other.head;
     }
 };
 BOOST_FUSION_ADAPT_STRUCT(
@@ -339,6 +346,7 @@ public:
     {
         http_raw_packet pack;
         _error = qi::phrase_parse(raw.begin(),raw.end(),raw_parse, ascii::blank,pack);
+        pack.head = raw.substr(0,raw.find("\r\n\r\n"));
         return pack;
     }
     bool error()const
@@ -375,6 +383,24 @@ public:
             return origin->body.at(name);
         return http_field();
     }
+    // Value of a header before it is split into params; repeated headers are
+    // joined with ", ". Empty when the packet was not built by parse().
+    std::string raw_field(const std::string &name)const
+    {
+        std::vector<std::string>lines;
+        std::string result;
+        boost::algorithm::split(lines,origin->head,boost::is_any_of("\n"));
+        for(size_t i(1);i < lines.size();++i)
+        {
+            auto pos = lines[i].find(':');
+            if(pos == std::string::npos || !boost::iequals(boost::trim_copy(lines[i].substr(0,pos)),name))
+                continue;
+            if(!result.empty())
+                result.append(", ");
+            result.append(boost::trim_copy(lines[i].substr(pos+1)));
+        }
+        return result;
+    }
     void set_field(std::string name,http_field field)
     {
         origin->body[name] = field;
@@ -392,4 +418,5 @@ public:
         start_line_parser p;
        return p(origin->start).is_request();
     }
-};
\ No newline at end of file
+};
+#endif // HTTP_PARSER_H
@@ -3,19 +3,95 @@
 #include <map>
 #include <queue>
 #include <fstream>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
 
 #include "posix_thread_wrapper.h"
 #include "http_parser.h"
+#include "response_cache.h"
+#include "response_stream.h"
+#include "asset_bundle.h"
 
 using namespace std;
 
+// Settings read from a "key=value" file at startup. A graceful restart execs
+// the binary again, so edits to this file take effect without dropping
+// connections. The port only applies when no listening fd is inherited.
+// When bundle names a file built by pack_bundle, it replaces root entirely.
+struct server_config{
+    int port = 1026;
+    int workers = 8;
+    std::string root = "/home/paul/http/my_dir";
+    std::string bundle;
+
+    // Returns false, after printing what is wrong, if the file cannot be used.
+    static bool load(const char *path,server_config &config)
+    {
+        if(!path)
+            return true;
+        std::ifstream file(path);
+        if(!file.is_open()){
+            std::cerr << "Error opening config " << path << std::endl;
+            return false;
+        }
+        std::string line;
+        for(int number(1);std::getline(file,line);++number)
+        {
+            auto pos = line.find('=');
+            if(line.empty() || line[0] == '#')
+                continue;
+            bool ok = false;
+            if(pos != std::string::npos){
+                std::string key = boost::trim_copy(line.substr(0,pos));
+                std::string value = boost::trim_copy(line.substr(pos+1));
+                if(key == "port")ok = boost::conversion::try_lexical_convert(value,config.port) && config.port > 0 && config.port < 65536;
+                else if(key == "workers")ok = boost::conversion::try_lexical_convert(value,config.workers) && config.workers > 0;
+                else if(key == "root"){config.root = value;ok = true;}
+                else if(key == "bundle"){config.bundle = value;ok = true;}
+            }
+            if(!ok){
+                std::cerr << "Error in config " << path << ":" << number << ": " << line << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
 class http_server{
 
+    static const char *listen_fd_env(){ return "HTTP_SERVER_LISTEN_FD"; }
+    static const char *ready_fd_env(){ return "HTTP_SERVER_READY_FD"; }
+    static int signal_pipe[2];
+    static void on_restart_signal(int)
+    {
+        int saved = errno;
+        write(signal_pipe[1],"",1);
+        errno = saved;
+    }
+
     std::queue<int>clients;
     std::vector<m_thread::thread*>threads;
     m_thread::mutex mtx;
     m_thread::condition_variable cond_var;
-    int sock;
+    response_cache cache;
+    stream_dispatcher streams;
+    asset_bundle bundle;
+    std::string root;
+    int active = 0;
+    int sock = -1;
+    char **restart_argv = nullptr;
+    int drain_seconds = 30;
+    int ready_seconds = 10;
+    int parent_ready_fd = -1;
+    pid_t successor = -1;
+    int successor_ready_fd = -1;
+    time_t successor_deadline = 0;
 
     static http_raw_packet read_from_socket(int cs)
     {
@@ -45,59 +121,284 @@ class http_server{
         file.close();
         return result;
     }
+    static void write_to_socket(int sock,const std::string &data)
+    {
+        write(sock,data.c_str(),data.size());
+        std::cerr << "Send packet:\n" << data;
+    }
+    // Sends head and a body straight out of memory with one writev where possible.
+    static void write_to_socket(int sock,const std::string &head,const char *body,size_t size)
+    {
+        struct iovec iov[2];
+        iov[0].iov_base = const_cast<char*>(head.data());
+        iov[0].iov_len = head.size();
+        iov[1].iov_base = const_cast<char*>(body);
+        iov[1].iov_len = size;
+        struct iovec *it = iov;
+        int count = 2;
+        while(count)
+        {
+            ssize_t sent = writev(sock,it,count);
+            if(sent <= 0)
+                break;
+            while(count && (size_t)sent >= it->iov_len){
+                sent -= it->iov_len;
+                ++it;
+                --count;
+            }
+            if(count){
+                it->iov_base = static_cast<char*>(it->iov_base) + sent;
+                it->iov_len -= sent;
+            }
+        }
+        std::cerr << "Send packet:\n" << head;
+    }
     static void write_to_socket(int sock,http_raw_packet response)
     {
         http_parser p;
-        write(sock,p.form(response).c_str(),p.form(response).size());
-        std::cerr << "Send packet:\n" << p.form(response);
+        write_to_socket(sock,p.form(response));
     }
 
+
+public:
+
     static http_raw_packet generate_response(RFC2616::responses response)
     {
         http_raw_packet resp;
         static std::map<RFC2616::responses,std::string>response_map{
             std::make_pair(RFC2616::OK,"OK"),
+            std::make_pair(RFC2616::NOT_MODIFIED,"Not Modified"),
             std::make_pair(RFC2616::NOT_FOUND,"Not Found")
         };
         resp.start = "HTTP/1.1 " + boost::lexical_cast<std::string>(response) + " " + response_map[response];
         return resp;
     }
 
-public:
-
-    http_server(int port,int poll_size) : mtx(m_thread::mutex::Normal){
+    http_server(int port,int poll_size,const std::string &root) : mtx(m_thread::mutex::Normal), root(root){
         struct sockaddr_in ss_addr;
 
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if(sock == -1)perror("Error creating socket");
-
-        setsockopt(sock, 1, SO_REUSEADDR, 0, 0);
+        if(const char *ready = getenv(ready_fd_env())){
+            parent_ready_fd = atoi(ready);
+            fcntl(parent_ready_fd,F_SETFD,FD_CLOEXEC);
+            unsetenv(ready_fd_env());
+        }
+        if(const char *inherited = getenv(listen_fd_env())){
+            sock = atoi(inherited);
+            unsetenv(listen_fd_env());
+        }
+        else{
+            sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if(sock == -1)perror("Error creating socket");
 
-        ss_addr.sin_family = AF_INET;
-        ss_addr.sin_addr.s_addr = INADDR_ANY;
-        ss_addr.sin_port = htons(port);
+            int reuse = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-        if(bind(sock, (struct sockaddr *) &ss_addr, sizeof(ss_addr)) != 0){perror("Error binding socket\n");};
-        if (listen(sock, 10) != 0)perror("Error listen socket");
+            ss_addr.sin_family = AF_INET;
+            ss_addr.sin_addr.s_addr = INADDR_ANY;
+            ss_addr.sin_port = htons(port);
 
-        for(int i(0);i != poll_size;++i)threads.push_back(new m_thread::thread(m_thread::thread::Detached,&http_server::thread_handle,&clients,&mtx,&cond_var));
+            if(bind(sock, (struct sockaddr *) &ss_addr, sizeof(ss_addr)) != 0){perror("Error binding socket\n");};
+            if (listen(sock, 10) != 0)perror("Error listen socket");
+        }
+        // During a handoff both processes accept from this socket, so neither may block in accept.
+        fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) | O_NONBLOCK);
+
+        // Workers inherit this mask, so restart signals always reach the accept loop.
+        sigset_t restart_signals,old_mask;
+        sigemptyset(&restart_signals);
+        sigaddset(&restart_signals,SIGHUP);
+        sigaddset(&restart_signals,SIGUSR2);
+        pthread_sigmask(SIG_BLOCK,&restart_signals,&old_mask);
+        for(int i(0);i != poll_size;++i)threads.push_back(new m_thread::thread(m_thread::thread::Detached,&http_server::thread_handle,&clients,&mtx,&cond_var,&cache,&streams,&bundle,&this->root,&active));
+        pthread_sigmask(SIG_SETMASK,&old_mask,NULL);
+    }
+    // On SIGHUP or SIGUSR2 re-exec argv with the listening socket handed over.
+    // Once the successor reports ready from its start(), stop accepting and
+    // exit when in-flight requests have finished or drain_seconds have passed.
+    // A successor that exits or stays silent for ready_seconds is killed and
+    // this process carries on serving.
+    void enable_graceful_restart(char *argv[],int drain_seconds,int ready_seconds = 10){
+        restart_argv = argv;
+        this->drain_seconds = drain_seconds;
+        this->ready_seconds = ready_seconds;
+
+        if(pipe2(signal_pipe,O_CLOEXEC | O_NONBLOCK) != 0){perror("Error creating signal pipe");return;}
+
+        struct sigaction sa;
+        memset(&sa,0,sizeof(sa));
+        sa.sa_handler = &http_server::on_restart_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGHUP,&sa,NULL);
+        sigaction(SIGUSR2,&sa,NULL);
+    }
+    void cache_route(const std::string &prefix,long ttl_ms,long stale_ms,
+                     const std::vector<std::string> &vary = std::vector<std::string>()){
+        cache.set_route(prefix,ttl_ms,stale_ms,vary);
+    }
+    // Serves GET requests from a pack_bundle file instead of the document root.
+    // Must be called before start().
+    bool load_bundle(const std::string &path){
+        return bundle.open(path);
+    }
+    // Handler writes the body through response_stream; headers go out on begin().
+    void stream_route(const std::string &prefix,const stream_dispatcher::stream_handler &handler){
+        streams.add_stream(prefix,handler);
+    }
+    // GET requests under prefix subscribe to Server-Sent Events published on prefix.
+    void event_route(const std::string &prefix){
+        streams.add_events(prefix);
+    }
+    void publish(const std::string &prefix,const std::string &event,const std::string &data){
+        streams.publish(prefix,event,data);
     }
     void start(){
+        if(parent_ready_fd != -1){
+            write(parent_ready_fd,"R",1);
+            close(parent_ready_fd);
+            parent_ready_fd = -1;
+        }
         for(;;) {
 
-            struct sockaddr_in cs_addr;
-            socklen_t cs_len = sizeof(cs_addr);
+            struct pollfd fds[3];
+            int count = 0;
+            fds[count].fd = sock;fds[count++].events = POLLIN;
+            fds[count].fd = signal_pipe[0];fds[count++].events = POLLIN;
+            if(successor != -1){fds[count].fd = successor_ready_fd;fds[count++].events = POLLIN;}
+            for(int i(0);i != count;++i)fds[i].revents = 0;
+
+            int timeout = successor == -1 ? -1 : std::max<int>(0,(successor_deadline - time(NULL)) * 1000);
+            if(poll(fds,count,timeout) == -1 && errno != EINTR)perror("Error polling");
+
+            if(fds[0].revents & POLLIN){
+                for(;;){
+                    struct sockaddr_in cs_addr;
+                    socklen_t cs_len = sizeof(cs_addr);
+
+                    int cs = accept4(sock, (struct sockaddr *) &cs_addr, &cs_len, SOCK_CLOEXEC);
+                    if (cs == -1)break;
+                    mtx.lock();clients.push(cs);cond_var.notify_one();mtx.unlock();
+                }
+            }
+            if(fds[1].revents & POLLIN){
+                char buffer[16];
+                while(read(signal_pipe[0],buffer,sizeof(buffer)) > 0);
+                if(restart_argv && successor == -1)spawn_successor();
+            }
+            if(successor != -1)check_successor(count == 3 && (fds[2].revents & (POLLIN | POLLHUP)));
+        }
+    }
+    ~http_server(){if(sock != -1)close(sock);for(auto it : threads)delete it;}
 
-            int cs = accept(sock, (struct sockaddr *) &cs_addr, &cs_len);
-            if (cs != -1){mtx.lock();clients.push(cs);cond_var.notify_one();mtx.unlock();}
+private:
 
+    static std::string find_executable(const std::string &name)
+    {
+        if(name.find('/') != std::string::npos)
+            return name;
+        std::vector<std::string>dirs;
+        const char *path = getenv("PATH");
+        boost::algorithm::split(dirs,path ? path : "/usr/bin:/bin",boost::is_any_of(":"));
+        for(auto &dir : dirs)
+        {
+            std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+            if(access(candidate.c_str(),X_OK) == 0)
+                return candidate;
         }
+        return name;
     }
-    ~http_server(){close(sock);for(auto it : threads)delete it;}
+    // Forks and execs a new copy of the server that shares sock and reports
+    // readiness on a pipe. Everything the child needs is built before fork(),
+    // so it only makes async-signal-safe calls.
+    void spawn_successor()
+    {
+        int ready_pipe[2];
+        if(pipe2(ready_pipe,O_CLOEXEC) != 0){perror("Error creating restart pipe");return;}
 
-private:
+        std::string executable = find_executable(restart_argv[0]);
+        std::vector<std::string>env_strings;
+        for(char **it = environ;*it;++it)
+        {
+            std::string var(*it);
+            if(var.compare(0,strlen(listen_fd_env())+1,std::string(listen_fd_env())+"=") != 0 &&
+               var.compare(0,strlen(ready_fd_env())+1,std::string(ready_fd_env())+"=") != 0)
+                env_strings.push_back(var);
+        }
+        env_strings.push_back(std::string(listen_fd_env()) + "=" + boost::lexical_cast<std::string>(sock));
+        env_strings.push_back(std::string(ready_fd_env()) + "=" + boost::lexical_cast<std::string>(ready_pipe[1]));
+        std::vector<char*>envp;
+        for(auto &var : env_strings)envp.push_back(&var[0]);
+        envp.push_back(NULL);
+
+        pid_t pid = fork();
+        if(pid == -1){
+            perror("Error forking successor");
+            close(ready_pipe[0]);
+            close(ready_pipe[1]);
+            return;
+        }
+        if(pid == 0){
+            fcntl(sock,F_SETFD,0);
+            fcntl(ready_pipe[1],F_SETFD,0);
+            sigset_t empty;
+            sigemptyset(&empty);
+            sigprocmask(SIG_SETMASK,&empty,NULL);
+            execve(executable.c_str(),restart_argv,envp.data());
+            _exit(127);
+        }
+
+        close(ready_pipe[1]);
+        successor = pid;
+        successor_ready_fd = ready_pipe[0];
+        successor_deadline = time(NULL) + ready_seconds;
+        std::cerr << "Started successor pid " << pid << std::endl;
+    }
+    // Hands over once the successor has written its ready byte; gives up on
+    // it if the pipe closes first or the deadline passes.
+    void check_successor(bool readable)
+    {
+        if(readable){
+            char byte;
+            ssize_t size;
+            while((size = read(successor_ready_fd,&byte,1)) == -1 && errno == EINTR);
+            close(successor_ready_fd);
+            successor_ready_fd = -1;
+            if(size == 1){
+                std::cerr << "Handed listening socket to pid " << successor << std::endl;
+                close(sock);
+                sock = -1;
+                drain();
+                // Detached workers may still be running, so skip static destructors.
+                _exit(0);
+            }
+            std::cerr << "Restart failed: successor pid " << successor << " exited before becoming ready" << std::endl;
+        }
+        else if(time(NULL) >= successor_deadline){
+            std::cerr << "Restart failed: successor pid " << successor << " not ready in time" << std::endl;
+            kill(successor,SIGKILL);
+            close(successor_ready_fd);
+            successor_ready_fd = -1;
+        }
+        else
+            return;
+        waitpid(successor,NULL,0);
+        successor = -1;
+    }
+    void drain()
+    {
+        for(int waited(0);waited != drain_seconds * 10;++waited){
+            mtx.lock();
+            bool idle = clients.empty() && !active;
+            mtx.unlock();
+            if(idle)
+                return;
+            usleep(100000);
+        }
+        std::cerr << "Drain deadline reached, exiting with requests in flight" << std::endl;
+    }
 
-    static void thread_handle(std::queue<int> *clients,m_thread::mutex *mtx, m_thread::condition_variable *cond_var)
+    static void thread_handle(std::queue<int> *clients,m_thread::mutex *mtx, m_thread::condition_variable *cond_var,
+                              response_cache *cache,stream_dispatcher *streams,const asset_bundle *bundle,
+                              const std::string *root,int *active)
     {
         for(;;){
 
@@ -106,67 +407,156 @@ private:
             while(!clients->size()){
                 cond_var->wait(*mtx);
             }
-            sock = clients->back();
+            sock = clients->front();
             clients->pop();
+            ++*active;
             mtx->unlock();
 
             auto pack = read_from_socket(sock);
             http_packet packet(&pack);
             auto line = packet.get_start().get<request_line>();
-            if(line.request.compare("GET") == 0)handle_get(packet,sock);
+            if(line.request.compare("GET") == 0 && !streams->handle(packet,sock,generate_response(RFC2616::OK)))
+                handle_get(packet,sock,cache,bundle,*root);
             close(sock);
+
+            mtx->lock();
+            --*active;
+            mtx->unlock();
         }
 
     }
-    static void handle_get(http_packet pack,int sock)
+    static void handle_get(http_packet pack,int sock,response_cache *cache,const asset_bundle *bundle,const std::string &root)
     {
-        static std::map<std::string,std::string>format_map{
-            std::make_pair("html","text/html"),
-                    std::make_pair("gif","image/gif"),
-                    std::make_pair("png","image/png"),
-                    std::make_pair("jpg","image/jpeg"),
-                    std::make_pair("css","text/css"),
-                    std::make_pair("js","application/javascript"),
-                    std::make_pair("swf","application/x-shockwave-flash"),
-                    std::make_pair("ico","image/x-icon"),
-                    std::make_pair("","text/plain"),
-                    std::make_pair("txt","text/plain"),
-                    std::make_pair("php","application/x-php")
-        };
+        std::string file_name = pack.get_start().get<request_line>().uri;
+        boost::replace_all(file_name,"%20","_");
+
+        if(bundle->is_open()){
+            serve_bundle(pack,sock,*bundle,file_name);
+            return;
+        }
+
+        write_to_socket(sock,cache->fetch("GET",file_name,pack,std::bind(&http_server::serve_file,root,file_name,std::placeholders::_1)));
+    }
+    // Takes the raw Accept-Encoding value: a list of codings, each with
+    // optional ";name=value" params of which only q matters. An explicit
+    // gzip (or x-gzip) entry decides; otherwise "*" does. A q that does not
+    // parse counts as 0.
+    static bool accepts_gzip(const std::string &header)
+    {
+        std::vector<std::string>codings;
+        boost::algorithm::split(codings,header,boost::is_any_of(","));
+        double gzip_q = -1,any_q = -1;
+        for(auto &coding : codings)
+        {
+            std::vector<std::string>parts;
+            boost::algorithm::split(parts,coding,boost::is_any_of(";"));
+            std::string name = boost::to_lower_copy(boost::trim_copy(parts[0]));
+            double q = 1;
+            for(size_t i(1);i < parts.size();++i)
+            {
+                auto pos = parts[i].find('=');
+                if(pos == std::string::npos || !boost::iequals(boost::trim_copy(parts[i].substr(0,pos)),"q"))
+                    continue;
+                if(!boost::conversion::try_lexical_convert(boost::trim_copy(parts[i].substr(pos+1)),q))
+                    q = 0;
+            }
+            if(name == "gzip" || name == "x-gzip")
+                gzip_q = std::max(gzip_q,q);
+            else if(name == "*")
+                any_q = std::max(any_q,q);
+        }
+        return gzip_q < 0 ? any_q > 0 : gzip_q > 0;
+    }
+    static void serve_bundle(http_packet &pack,int sock,const asset_bundle &bundle,const std::string &file_name)
+    {
+        http_parser p;
+        http_field type,length,etag,encoding,vary;
+
+        const bundle_format::entry *entry = bundle.find(file_name);
+        if(!entry){
+            http_raw_packet response = generate_response(RFC2616::NOT_FOUND);
+            length.value = "0";
+            response.body.insert(std::make_pair("Content-Length",length));
+            write_to_socket(sock,p.form(response) + "\r\n");
+            return;
+        }
+
+        uint64_t offset = entry->body_offset,size = entry->body_size;
+        bool gzipped = entry->gzip_size && accepts_gzip(pack.raw_field("Accept-Encoding"));
+        etag.value = bundle.etag(*entry);
+        vary.value = "Accept-Encoding";
+        if(gzipped){
+            offset = entry->gzip_offset;
+            size = entry->gzip_size;
+            // Each content-coding needs its own strong validator.
+            etag.value.insert(etag.value.size() - 1,"-gz");
+        }
+
+        if(pack["If-None-Match"].value.find(etag.value) != std::string::npos){
+            http_raw_packet response = generate_response(RFC2616::NOT_MODIFIED);
+            response.body.insert(std::make_pair("ETag",etag));
+            if(entry->gzip_size)response.body.insert(std::make_pair("Vary",vary));
+            write_to_socket(sock,p.form(response) + "\r\n");
+            return;
+        }
 
+        http_raw_packet response = generate_response(RFC2616::OK);
+        if(entry->gzip_size)response.body.insert(std::make_pair("Vary",vary));
+        if(gzipped){
+            encoding.value = "gzip";
+            response.body.insert(std::make_pair("Content-Encoding",encoding));
+        }
+        type.value = bundle.mime(*entry);
+        type.params.insert(std::make_pair("charset","utf-8"));
+        length.value = boost::lexical_cast<std::string>(size);
+        response.body.insert(std::make_pair("Content-Type",type));
+        response.body.insert(std::make_pair("Content-Length",length));
+        response.body.insert(std::make_pair("ETag",etag));
+
+        write_to_socket(sock,p.form(response) + "\r\n",bundle.data(offset),size);
+    }
+    // Returns false for responses the cache must not keep.
+    static bool serve_file(const std::string &root,const std::string &file_name,std::string &data)
+    {
+        http_parser p;
         http_raw_packet response;
         std::ifstream file;
-        std::vector<std::string>segments;
         http_field field1,field2;
 
-        std::string file_name = pack.get_start().get<request_line>().uri;
-        boost::replace_all(file_name,"%20","_");
-
-        file.open("/home/paul/http/my_dir" + file_name,std::ios::in | std::ios::binary);
+        file.open(root + file_name,std::ios::in | std::ios::binary);
 
         if(!file.is_open()){
-            write_to_socket(sock,generate_response(RFC2616::NOT_FOUND));
-            return;
+            data = p.form(generate_response(RFC2616::NOT_FOUND));
+            return false;
         }
 
-        boost::algorithm::split(segments,file_name,boost::is_any_of("."));
-
         response = generate_response(RFC2616::OK);
         auto info = load_from_file(file);
 
-        field1.value = format_map[segments.back()];
+        field1.value = mime_type(file_name);
         field2.value = boost::lexical_cast<std::string>(info.size());
         field1.params.insert(std::make_pair("charset","utf-8"));
         response.body.insert(std::make_pair("Content-Type",field1));
         response.body.insert(std::make_pair("Content-Length",field2));
         response.content = info;
 
-        write_to_socket(sock,response);
+        data = p.form(response);
+        return true;
     }
 };
-int main()
+int http_server::signal_pipe[2] = {-1,-1};
+
+int main(int argc,char *argv[])
 {
-    http_server server(1026,8);
+    server_config config;
+    if(!server_config::load(argc > 1 ? argv[1] : nullptr,config))
+        return 1;
+    http_server server(config.port,config.workers,config.root);
+    // Exit before start() so a restart with a bad bundle never reports ready.
+    // Workers are already running, so skip destructors as the drain path does.
+    if(!config.bundle.empty() && !server.load_bundle(config.bundle))
+        _exit(1);
+    server.enable_graceful_restart(argv,30);
     server.start();
     return 0;
 }
@@ -0,0 +1,180 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <dirent.h>
+#include <zlib.h>
+
+#include "asset_bundle.h"
+
+// Offline tool: packs a document root into one bundle file for http_server.
+// The bundle is written next to the output and renamed into place, so a
+// running server never sees a partial file.
+//
+//   pack_bundle <document_root> <output>
+
+struct packed_file{
+    std::string path;
+    std::string mime;
+    std::string etag;
+    std::string body;
+    std::string gzip;
+};
+
+static std::string load_file(const std::string &name)
+{
+    std::ifstream file(name,std::ios::in | std::ios::binary);
+    std::ostringstream result;
+    result << file.rdbuf();
+    return result.str();
+}
+static std::string gzip(const std::string &data)
+{
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    if(deflateInit2(&zs,Z_BEST_COMPRESSION,Z_DEFLATED,15 + 16,9,Z_DEFAULT_STRATEGY) != Z_OK)
+        return std::string();
+
+    std::string result(deflateBound(&zs,data.size()),'\0');
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*)&result[0];
+    zs.avail_out = result.size();
+    int status = deflate(&zs,Z_FINISH);
+    result.resize(zs.total_out);
+    deflateEnd(&zs);
+    return status == Z_STREAM_END ? result : std::string();
+}
+static void collect(const std::string &root,const std::string &prefix,std::vector<packed_file> &files)
+{
+    DIR *dir = opendir((root + prefix).c_str());
+    if(!dir){perror(("Error opening " + root + prefix).c_str());return;}
+
+    while(struct dirent *ent = readdir(dir))
+    {
+        std::string name(ent->d_name);
+        if(name == "." || name == "..")
+            continue;
+        std::string path = prefix + "/" + name;
+        struct stat st;
+        if(stat((root + path).c_str(),&st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode)){
+            collect(root,path,files);
+            continue;
+        }
+        if(!S_ISREG(st.st_mode))
+            continue;
+
+        packed_file file;
+        file.path = path;
+        file.mime = mime_type(path);
+        file.body = load_file(root + path);
+        char etag[20];
+        snprintf(etag,sizeof(etag),"%016llx",(unsigned long long)bundle_format::hash(file.body.data(),file.body.size()));
+        file.etag = "\"" + std::string(etag) + "\"";
+        file.gzip = gzip(file.body);
+        // Only worth a second copy when it saves a tenth or more.
+        if(file.gzip.size() * 10 > file.body.size() * 9)
+            file.gzip.clear();
+        files.push_back(file);
+    }
+    closedir(dir);
+}
+static uint64_t page_align(uint64_t offset)
+{
+    return (offset + bundle_format::page_size - 1) / bundle_format::page_size * bundle_format::page_size;
+}
+static bool write_at(std::ofstream &out,uint64_t offset,const std::string &data)
+{
+    uint64_t pos = out.tellp();
+    if(offset > pos)
+        out << std::string(offset - pos,'\0');
+    out.write(data.data(),data.size());
+    return static_cast<bool>(out);
+}
+
+int main(int argc,char *argv[])
+{
+    if(argc != 3){
+        std::cerr << "Usage: " << argv[0] << " <document_root> <output>" << std::endl;
+        return 1;
+    }
+    std::string root(argv[1]);
+    std::string output(argv[2]);
+    std::string temp = output + ".tmp";
+
+    std::vector<packed_file>files;
+    collect(root,"",files);
+    std::sort(files.begin(),files.end(),[](const packed_file &a,const packed_file &b){ return a.path < b.path; });
+
+    bundle_format::header header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,bundle_format::magic,sizeof(header.magic));
+    header.version = bundle_format::version;
+    header.entry_count = files.size();
+    header.slot_count = 2;
+    while(header.slot_count < files.size() * 2)header.slot_count *= 2;
+    header.entries_offset = sizeof(header);
+    header.slots_offset = header.entries_offset + files.size() * sizeof(bundle_format::entry);
+    header.strings_offset = header.slots_offset + header.slot_count * sizeof(uint32_t);
+
+    std::string strings;
+    std::vector<bundle_format::entry>entries(files.size());
+    std::vector<uint32_t>slots(header.slot_count,0);
+    auto add_string = [&strings](const std::string &str,uint32_t &offset,uint32_t &size){
+        offset = strings.size();
+        size = str.size();
+        strings.append(str);
+    };
+    for(size_t i(0);i != files.size();++i)
+    {
+        bundle_format::entry &e = entries[i];
+        memset(&e,0,sizeof(e));
+        e.hash = bundle_format::hash(files[i].path.data(),files[i].path.size());
+        add_string(files[i].path,e.path_offset,e.path_size);
+        add_string(files[i].mime,e.mime_offset,e.mime_size);
+        add_string(files[i].etag,e.etag_offset,e.etag_size);
+
+        uint32_t slot = e.hash & (header.slot_count - 1);
+        while(slots[slot])slot = (slot + 1) & (header.slot_count - 1);
+        slots[slot] = i + 1;
+    }
+    header.strings_size = strings.size();
+
+    uint64_t cursor = page_align(header.strings_offset + header.strings_size);
+    for(size_t i(0);i != files.size();++i)
+    {
+        entries[i].body_offset = cursor;
+        entries[i].body_size = files[i].body.size();
+        cursor = page_align(cursor + files[i].body.size());
+        if(!files[i].gzip.empty()){
+            entries[i].gzip_offset = cursor;
+            entries[i].gzip_size = files[i].gzip.size();
+            cursor = page_align(cursor + files[i].gzip.size());
+        }
+    }
+
+    std::ofstream out(temp,std::ios::out | std::ios::binary | std::ios::trunc);
+    bool ok = write_at(out,0,std::string((const char*)&header,sizeof(header)));
+    ok = ok && write_at(out,header.entries_offset,std::string((const char*)entries.data(),entries.size() * sizeof(bundle_format::entry)));
+    ok = ok && write_at(out,header.slots_offset,std::string((const char*)slots.data(),slots.size() * sizeof(uint32_t)));
+    ok = ok && write_at(out,header.strings_offset,strings);
+    for(size_t i(0);ok && i != files.size();++i)
+    {
+        ok = write_at(out,entries[i].body_offset,files[i].body);
+        if(ok && entries[i].gzip_size)
+            ok = write_at(out,entries[i].gzip_offset,files[i].gzip);
+    }
+    out.close();
+
+    if(!ok || out.fail() || rename(temp.c_str(),output.c_str()) != 0){
+        perror(("Error writing " + output).c_str());
+        remove(temp.c_str());
+        return 1;
+    }
+    std::cerr << "Packed " << files.size() << " files into " << output << std::endl;
+    return 0;
+}
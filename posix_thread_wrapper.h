@@ -27,18 +27,18 @@ private:
 public:
 
     mutex(mtx_type type){
-        static std::map<mtx_type,std::function<void()>>init_map = {
-                std::make_pair(Normal,[&](){
-            pthread_mutex_init(&mtx,NULL);
+        static std::map<mtx_type,std::function<void(pthread_mutex_t*)>>init_map = {
+                std::make_pair(Normal,[](pthread_mutex_t *mtx){
+            pthread_mutex_init(mtx,NULL);
         }),
-                std::make_pair(Recursive,[&](){
+                std::make_pair(Recursive,[](pthread_mutex_t *mtx){
             pthread_mutexattr_t attr;
             pthread_mutexattr_init(&attr);
             pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-            pthread_mutex_init(&mtx, &attr);
+            pthread_mutex_init(mtx, &attr);
         })
     };
-        init_map[type]();
+        init_map[type](&mtx);
     }
     void lock(){
         pthread_mutex_lock(&mtx);
@@ -0,0 +1,234 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "posix_thread_wrapper.h"
+#include "http_parser.h"
+
+// Shared cache of fully serialized responses (output of http_parser::form).
+// Entries are keyed by method, uri and the route's Vary headers and spread
+// over independently locked shards of at most shard_limit entries; a full
+// shard drops expired entries first and then the oldest one. Concurrent
+// misses on one key run the generator once and the other callers take its
+// result. Within the stale window a single caller revalidates while the rest
+// keep getting the old copy.
+class response_cache{
+
+public:
+
+    // Fills data and returns whether it may be stored, e.g. false for a 404.
+    typedef std::function<bool(std::string&)> generator;
+
+    struct route_policy{
+        long ttl_ms;
+        long stale_ms;
+        std::vector<std::string> vary;
+    };
+
+private:
+
+    typedef std::chrono::steady_clock clock;
+
+    // Result of one generator run, shared with the callers waiting on it.
+    struct fill{
+        bool done = false;
+        bool failed = false;
+        std::string data;
+    };
+    struct entry{
+        std::string data;
+        clock::time_point stored;
+        clock::time_point expires;
+        clock::time_point stale_until;
+        bool ready = false;
+        std::shared_ptr<fill> pending;
+    };
+    struct shard{
+        m_thread::mutex mtx;
+        m_thread::condition_variable cond_var;
+        std::map<std::string,entry> entries;
+
+        shard() : mtx(m_thread::mutex::Normal){}
+    };
+
+    std::vector<std::unique_ptr<shard>>shards;
+    std::map<std::string,route_policy>routes;
+    size_t shard_limit;
+
+    const route_policy *find_route(const std::string &uri)const
+    {
+        const route_policy *result = nullptr;
+        size_t best = 0;
+        for(auto &it : routes)
+        {
+            if(it.first.size() >= best && uri.compare(0,it.first.size(),it.first) == 0)
+            {
+                best = it.first.size();
+                result = &it.second;
+            }
+        }
+        return result;
+    }
+    static std::string make_key(const std::string &method,const std::string &uri,
+                                const http_packet &pack,const route_policy &policy)
+    {
+        std::string key(method);
+        key.append(" ");
+        key.append(uri);
+        for(auto &name : policy.vary)
+        {
+            key.append("\n");
+            key.append(name);
+            key.append(":");
+            key.append(pack[name].value);
+        }
+        return key;
+    }
+    shard &shard_for(const std::string &key)
+    {
+        return *shards[std::hash<std::string>()(key) % shards.size()];
+    }
+    // Returns false when every entry is mid-generation and nothing can go.
+    bool make_room(shard &s,clock::time_point now)
+    {
+        if(s.entries.size() < shard_limit)
+            return true;
+        auto oldest = s.entries.end();
+        for(auto it = s.entries.begin();it != s.entries.end();)
+        {
+            if(!it->second.ready || it->second.pending)
+                ++it;
+            else if(it->second.stale_until <= now)
+                it = s.entries.erase(it);
+            else{
+                if(oldest == s.entries.end() || it->second.stored < oldest->second.stored)
+                    oldest = it;
+                ++it;
+            }
+        }
+        if(s.entries.size() < shard_limit)
+            return true;
+        if(oldest == s.entries.end())
+            return false;
+        s.entries.erase(oldest);
+        return true;
+    }
+    void complete(shard &s,const std::string &key,const std::shared_ptr<fill> &mine,
+                  const route_policy &policy,bool cacheable)
+    {
+        auto it = s.entries.find(key);
+        if(it != s.entries.end()){
+            entry &e = it->second;
+            if(cacheable){
+                e.data = mine->data;
+                e.ready = true;
+                e.stored = clock::now();
+                e.expires = e.stored + std::chrono::milliseconds(policy.ttl_ms);
+                e.stale_until = e.expires + std::chrono::milliseconds(policy.stale_ms);
+                e.pending.reset();
+            }
+            else if(mine->failed && e.ready)
+                e.pending.reset();
+            else
+                s.entries.erase(it);
+        }
+        mine->done = true;
+        s.cond_var.notify_all();
+    }
+
+public:
+
+    response_cache(size_t shard_count = 16,size_t shard_limit = 1024) : shard_limit(shard_limit)
+    {
+        for(size_t i(0);i != shard_count;++i)shards.emplace_back(new shard);
+    }
+
+    // Routes are matched by longest uri prefix. Must be configured before
+    // the cache is shared with worker threads.
+    void set_route(const std::string &prefix,long ttl_ms,long stale_ms,
+                   const std::vector<std::string> &vary = std::vector<std::string>())
+    {
+        route_policy policy;
+        policy.ttl_ms = ttl_ms;
+        policy.stale_ms = stale_ms;
+        policy.vary = vary;
+        routes[prefix] = policy;
+    }
+
+    std::string fetch(const std::string &method,const std::string &uri,
+                      const http_packet &pack,const generator &gen)
+    {
+        const route_policy *policy = find_route(uri);
+        std::string data;
+        if(!policy){
+            gen(data);
+            return data;
+        }
+
+        std::string key = make_key(method,uri,pack,*policy);
+        shard &s = shard_for(key);
+        std::shared_ptr<fill> mine;
+
+        s.mtx.lock();
+        for(;;){
+            auto now = clock::now();
+            auto it = s.entries.find(key);
+            if(it == s.entries.end()){
+                if(!make_room(s,now)){
+                    s.mtx.unlock();
+                    gen(data);
+                    return data;
+                }
+                mine = std::make_shared<fill>();
+                s.entries[key].pending = mine;
+                break;
+            }
+            entry &e = it->second;
+            if(e.ready && (now < e.expires || (e.pending && now < e.stale_until))){
+                data = e.data;
+                s.mtx.unlock();
+                return data;
+            }
+            if(!e.pending){
+                mine = std::make_shared<fill>();
+                e.pending = mine;
+                break;
+            }
+            std::shared_ptr<fill> waiting = e.pending;
+            while(!waiting->done)
+                s.cond_var.wait(s.mtx);
+            if(!waiting->failed){
+                data = waiting->data;
+                s.mtx.unlock();
+                return data;
+            }
+        }
+        s.mtx.unlock();
+
+        bool cacheable;
+        try{
+            cacheable = gen(mine->data);
+        }
+        catch(...){
+            s.mtx.lock();
+            mine->failed = true;
+            complete(s,key,mine,*policy,false);
+            s.mtx.unlock();
+            throw;
+        }
+
+        s.mtx.lock();
+        complete(s,key,mine,*policy,cacheable);
+        data = mine->data;
+        s.mtx.unlock();
+        return data;
+    }
+};
+
+#endif // RESPONSE_CACHE_H
@@ -0,0 +1,242 @@
+#ifndef RESPONSE_STREAM_H
+#define RESPONSE_STREAM_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "posix_thread_wrapper.h"
+#include "http_parser.h"
+
+// Writes a response incrementally with Transfer-Encoding: chunked. Writes
+// block while the client's socket buffer is full, so a slow reader throttles
+// the handler; a client that stalls past the send timeout fails the stream.
+class response_stream{
+
+    int sock;
+    http_raw_packet default_head;
+    bool started = false;
+    bool failed = false;
+
+    bool write_all(const std::string &data)
+    {
+        size_t sent = 0;
+        while(!failed && sent != data.size())
+        {
+            ssize_t size = send(sock,data.data()+sent,data.size()-sent,MSG_NOSIGNAL);
+            if(size <= 0)
+                failed = true;
+            else
+                sent += size;
+        }
+        return !failed;
+    }
+
+public:
+
+    // default_head is sent if the handler writes without calling begin().
+    response_stream(int sock,const http_raw_packet &default_head,int send_timeout_seconds = 30) :
+        sock(sock), default_head(default_head)
+    {
+        struct timeval tv;
+        tv.tv_sec = send_timeout_seconds;
+        tv.tv_usec = 0;
+        setsockopt(sock,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    }
+
+    // Sends the start line and headers of head right away; head.content is
+    // ignored. Returns false if the headers have already gone out.
+    bool begin(http_raw_packet head)
+    {
+        if(started)
+            return false;
+        http_parser p;
+        http_field field;
+        field.value = "chunked";
+        head.body.erase("Content-Length");
+        head.body["Transfer-Encoding"] = field;
+        head.content.clear();
+        started = true;
+        return write_all(p.form(head) + "\r\n");
+    }
+    bool write(const std::string &chunk)
+    {
+        if(!started && !begin(default_head))
+            return false;
+        if(chunk.empty())
+            return !failed;
+        char size[20];
+        snprintf(size,sizeof(size),"%zx\r\n",chunk.size());
+        return write_all(size + chunk + "\r\n");
+    }
+    bool finish()
+    {
+        if(!started && !begin(default_head))
+            return false;
+        return write_all("0\r\n\r\n");
+    }
+    bool is_started()const { return started; }
+    bool is_failed()const { return failed; }
+};
+
+// Keeps Server-Sent Events subscribers as bare non-blocking sockets grouped by
+// channel, so an idle subscriber costs one fd rather than a worker thread.
+// Subscribers that cannot take a whole event without blocking are dropped;
+// browsers reconnect on their own.
+class sse_hub{
+
+    m_thread::mutex mtx;
+    std::map<std::string,std::vector<int>>channels;
+    std::unique_ptr<m_thread::thread>heartbeat_thread;
+    int heartbeat_seconds;
+
+    static bool try_send(int fd,const std::string &data)
+    {
+        return send(fd,data.data(),data.size(),MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)data.size();
+    }
+    void broadcast(std::vector<int> &fds,const std::string &data)
+    {
+        for(auto it = fds.begin();it != fds.end();)
+        {
+            if(try_send(*it,data))
+                ++it;
+            else{
+                close(*it);
+                it = fds.erase(it);
+            }
+        }
+    }
+    static void heartbeat_loop(sse_hub *hub,int interval_seconds)
+    {
+        for(;;){
+            sleep(interval_seconds);
+            m_thread::lock_guard<m_thread::mutex> lock(&hub->mtx);
+            for(auto &it : hub->channels)
+                hub->broadcast(it.second,": ping\n\n");
+        }
+    }
+
+public:
+
+    sse_hub(int heartbeat_seconds = 15) : mtx(m_thread::mutex::Normal), heartbeat_seconds(heartbeat_seconds){}
+
+    // Sends the event-stream headers on sock and keeps a duplicate of it, so
+    // the caller may close its own descriptor as usual.
+    void subscribe(const std::string &channel,int sock,http_raw_packet head)
+    {
+        http_parser p;
+        http_field type,cache;
+        type.value = "text/event-stream";
+        cache.value = "no-cache";
+        head.body["Content-Type"] = type;
+        head.body["Cache-Control"] = cache;
+        head.content.clear();
+
+        int fd = fcntl(sock,F_DUPFD_CLOEXEC,0);
+        if(fd == -1)
+            return;
+        if(!try_send(fd,p.form(head) + "\r\n")){
+            close(fd);
+            return;
+        }
+        fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+
+        m_thread::lock_guard<m_thread::mutex> lock(&mtx);
+        channels[channel].push_back(fd);
+        // Started from a worker so the thread inherits its signal mask.
+        if(!heartbeat_thread)
+            heartbeat_thread.reset(new m_thread::thread(m_thread::thread::Detached,&sse_hub::heartbeat_loop,this,heartbeat_seconds));
+    }
+    void publish(const std::string &channel,const std::string &event,const std::string &data)
+    {
+        std::string message;
+        if(!event.empty())
+            message.append("event: " + event + "\n");
+        std::vector<std::string>lines;
+        boost::algorithm::split(lines,data,boost::is_any_of("\n"));
+        for(auto &line : lines)
+            message.append("data: " + line + "\n");
+        message.append("\n");
+
+        m_thread::lock_guard<m_thread::mutex> lock(&mtx);
+        auto it = channels.find(channel);
+        if(it != channels.end())
+            broadcast(it->second,message);
+    }
+};
+
+// Routes GET requests to streaming handlers or SSE channels by longest uri
+// prefix. Routes must be registered before workers start taking requests.
+class stream_dispatcher{
+
+public:
+
+    typedef std::function<void(http_packet&,response_stream&)> stream_handler;
+
+private:
+
+    struct route{
+        stream_handler handler;
+        bool events;
+    };
+
+    std::map<std::string,route>routes;
+    sse_hub hub;
+
+    const std::pair<const std::string,route> *find_route(const std::string &uri)const
+    {
+        const std::pair<const std::string,route> *result = nullptr;
+        for(auto &it : routes)
+        {
+            if(uri.compare(0,it.first.size(),it.first) == 0 && (!result || it.first.size() > result->first.size()))
+                result = &it;
+        }
+        return result;
+    }
+
+public:
+
+    void add_stream(const std::string &prefix,const stream_handler &handler)
+    {
+        route r;
+        r.handler = handler;
+        r.events = false;
+        routes[prefix] = r;
+    }
+    void add_events(const std::string &prefix)
+    {
+        route r;
+        r.events = true;
+        routes[prefix] = r;
+    }
+    void publish(const std::string &channel,const std::string &event,const std::string &data)
+    {
+        hub.publish(channel,event,data);
+    }
+
+    // Returns false when no route matches and the request should be served normally.
+    bool handle(http_packet &pack,int sock,const http_raw_packet &ok_head)
+    {
+        std::string uri = pack.get_start().get<request_line>().uri;
+        auto match = find_route(uri);
+        if(!match)
+            return false;
+
+        if(match->second.events){
+            hub.subscribe(match->first,sock,ok_head);
+            return true;
+        }
+
+        response_stream stream(sock,ok_head);
+        match->second.handler(pack,stream);
+        stream.finish();
+        return true;
+    }
+};
+
+#endif // RESPONSE_STREAM_H